@@ -4,6 +4,13 @@
 #include <utility>
 #include <cstring>
 #include <utility>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <thread>
+#include <memory>
+#include <mutex>
 
 enum class operating_system { WINDOWS, OTHER };
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
@@ -12,6 +19,11 @@ enum class operating_system { WINDOWS, OTHER };
 #define OS_OTHER
 #endif // Define OS
 
+#ifdef OS_OTHER
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef NDEBUG
 static void assert(bool, const char* = "") {}
 #else
@@ -24,6 +36,7 @@ template<class T> class unique_ref;
 template<class T> class shared_ref;
 template<class T> class weak_ref;
 template<class T> class ref;
+template<class T, size_t inline_size = 16> class small_ref;
 
 class alloc_t;
 
@@ -36,11 +49,56 @@ struct blk {
         return (ptr != nullptr);
     }
 
+    // A relocating allocator hands out blks that point at its handle table entry
+    // rather than the object, these are marked by the top bit of m_size.
+    static constexpr size_t indirect_flag = size_t(1) << (sizeof(size_t) * 8 - 1);
+
+    bool isIndirect() const {
+        return (m_size & indirect_flag) != 0;
+    }
+
+    void* get() const {
+        if (isIndirect()) [[unlikely]] return *(void**)ptr;
+        return ptr;
+    }
+
+    // The raw ptr, allocators use this on their own blocks. Typed access goes through get().
     void* operator&() {
         return ptr;
     }
 };
 
+// --- Type erased destructor, so allocators can destroy objects they do not know the type of ---
+using destructor_fn = void (*)(void*);
+
+template<class T>
+void destroy_as(void* object) {
+	static_cast<T*>(object)->~T();
+}
+
+// --- Type erased move, so relocating allocators can move objects they do not know the type of ---
+using relocate_fn = void (*)(void* from, void* to);
+
+template<class T>
+void relocate_as(void* from, void* to) {
+	if constexpr (std::is_trivially_copyable<T>::value) {
+		memcpy(to, from, sizeof(T));
+	} else {
+		new (to) T(std::move(*static_cast<T*>(from)));
+		static_cast<T*>(from)->~T();
+	}
+}
+
+// Objects that cannot be moved get no relocate function, and are pinned in place.
+template<class T>
+constexpr relocate_fn relocator_of() {
+	if constexpr (std::is_trivially_copyable<T>::value || std::is_move_constructible<T>::value) {
+		return &relocate_as<T>;
+	} else {
+		return nullptr;
+	}
+}
+
 // --- Global Allocator Interface ---
 class alloc_t {
  public:
@@ -51,9 +109,28 @@ class alloc_t {
 	virtual bool will_free_on_deallocate(blk& resource) = 0;
 	virtual blk share(blk& resource) = 0;
 
+	// Called by ref<T> when a handle lets go of its blk. By default the object is
+	// destroyed straight away if this was the last handle, allocators can override
+	// this to defer the destruction (See DeferredRefCounted<>).
+	virtual void release(blk& resource, destructor_fn destroy) {
+		if (will_free_on_deallocate(resource)) {
+			destroy(resource.get());
+		}
+		deallocate(resource);
+	}
+
+	// Drops one share of resource, unless it is the last one. Returns false, leaving
+	// resource untouched, when the caller holds the last handle. Nothing is shared by default.
+	virtual bool unshare(blk&) { return false; }
+
+	// Called once an object of type T has been constructed in resource. Allocators
+	// that move objects around keep the relocate function, nothing to do by default.
+	virtual void set_relocator(blk&, relocate_fn) {}
+
 	template<class T, class AS = T, typename... Args> ref<AS> make(Args&&...);
 
 	template<class T, class AS = T, typename... Args> unique_ref<AS> make_unique(Args&&...);
+	template<class T, size_t inline_size = 16, typename... Args> small_ref<T, inline_size> make_small(Args&&...);
 	template<class T, class AS = T> void do_move(ref<T>& original);
 	template<class T, class AS = T> typename std::remove_reference<T>::type&& move(T&& original );
 
@@ -94,9 +171,10 @@ class ref {
 		//printf("copy constructor, m_alloc = %p\n", m_alloc);
 		m_data = m_alloc->allocate(sizeof(T), alignof(T));
 		assert(m_data.ptr);
-		auto org_obj = static_cast<T*>(original.m_data.ptr);
-		auto new_obj = static_cast<T*>(m_data.ptr);
+		auto org_obj = static_cast<T*>(original.m_data.get());
+		auto new_obj = static_cast<T*>(m_data.get());
 		*new_obj = *org_obj;
+		m_alloc->set_relocator(m_data, relocator_of<T>());
 		//new (m_data.ptr) T(*org_obj);
 
 		//printf("copied [%p] to [%p]\n", original.m_data.ptr, &m_data);
@@ -106,19 +184,17 @@ class ref {
     ref& operator=(ref& original) {
         // Clean up the old data we we're holding.
         if ((m_data.hasData()) && ( m_ref_type != type::weak_ref) ) {
-            if (m_alloc->will_free_on_deallocate(m_data)) {
-                (static_cast<T*>(m_data.ptr))->~T();
-            }
-            m_alloc->deallocate(m_data);
+            m_alloc->release(m_data, &destroy_as<T>);
         }
 
         m_ref_type = type::shared_ref;
         m_alloc = original.m_alloc;
         m_data = m_alloc->allocate(sizeof(T), alignof(T));
         assert(m_data.ptr);
-        auto org_obj = static_cast<T*>(original.m_data.ptr);
-        auto new_obj = static_cast<T*>(m_data.ptr);
+        auto org_obj = static_cast<T*>(original.m_data.get());
+        auto new_obj = static_cast<T*>(m_data.get());
         *new_obj = *org_obj;
+        m_alloc->set_relocator(m_data, relocator_of<T>());
         //new (m_data.ptr) T(*org_obj);
 
         //printf("copied = [%p] to [%p]\n", original.m_data.ptr, &m_data);
@@ -155,10 +231,7 @@ class ref {
     ref& operator=(ref&& original) {
         // Clean up the old data we we're holding.
         if ((m_data.hasData()) && (m_ref_type != type::weak_ref)) {
-            if (m_alloc->will_free_on_deallocate(m_data)) {
-                (static_cast<T*>(m_data.ptr))->~T();
-            }
-            m_alloc->deallocate(m_data);
+            m_alloc->release(m_data, &destroy_as<T>);
         }
 
         m_ref_type = original.m_ref_type;
@@ -206,7 +279,7 @@ class ref {
         if (!m_data.hasData()) {
             assert(0, "nullptr dereference!");
         }
-        return static_cast<T*>(m_data.ptr);
+        return static_cast<T*>(m_data.get());
     }
 
     // --- Deconstructor ---
@@ -215,11 +288,7 @@ class ref {
         if (m_ref_type == type::weak_ref) return;
 
         if (m_data.hasData()) {
-			//printf("%d\n", m_alloc->will_free_on_deallocate(m_data));
-			if (m_alloc->will_free_on_deallocate(m_data)) {
-				static_cast<T*>(m_data.ptr)->~T();
-			}
-			m_alloc->deallocate(m_data);
+			m_alloc->release(m_data, &destroy_as<T>);
 		}
     }
 };
@@ -240,12 +309,162 @@ template<class T> class unique_ref: public ref<T> {
 	unique_ref(blk data, alloc_t* alloc): ref<T>(data, alloc) {}
 };
 
+// --- Small Object Handle ---
+// A ref< T > that keeps T inside the handle, when T fits in inline_size bytes,
+// so small values never touch the allocator. Copies are deep copies, like ref< T >.
+// Sharing moves the object into the allocator first, after which it behaves as a
+// normal ref< T >. Raw pointers taken from operator->() do not survive that move.
+template<class T, size_t inline_size>
+class small_ref {
+ public:
+	static constexpr bool fits = sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t);
+ private:
+	// Types that do not fit only ever use m_data, so they get no buffer.
+	union {
+		alignas(fits ? alignof(T) : alignof(blk)) unsigned char m_inline[fits ? sizeof(T) : 1];
+		blk m_data;
+	};
+	alloc_t* m_alloc;
+	bool m_is_inline;
+
+	T* inline_object() {
+		return std::launder(reinterpret_cast<T*>(m_inline));
+	}
+
+	T const* inline_object() const {
+		return std::launder(reinterpret_cast<T const*>(m_inline));
+	}
+
+	template<typename... Args>
+	void make_in_allocator(Args&&... args) {
+		m_data = m_alloc->allocate(sizeof(T), alignof(T));
+		new (m_data.get()) T(std::forward<Args>(args)...);
+		m_alloc->set_relocator(m_data, relocator_of<T>());
+		m_is_inline = false;
+	}
+
+	void reset() {
+		if constexpr (fits) {
+			if (m_is_inline) {
+				inline_object()->~T();
+				return;
+			}
+		}
+		if (m_data.hasData()) {
+			m_alloc->release(m_data, &destroy_as<T>);
+		}
+	}
+
+	void promote() {
+		if constexpr (fits) {
+			if (!m_is_inline) return;
+
+			T moved(std::move(*inline_object()));
+			inline_object()->~T();
+			make_in_allocator(std::move(moved));
+		}
+	}
+ public:
+	// --- Initialisation Constructor, see make_small() ---
+	template<typename... Args>
+	small_ref(alloc_t* alloc, std::in_place_t, Args&&... args): m_alloc(alloc) {
+		if constexpr (fits) {
+			new (m_inline) T(std::forward<Args>(args)...);
+			m_is_inline = true;
+		} else {
+			make_in_allocator(std::forward<Args>(args)...);
+		}
+	}
+
+	// --- Copy Constructor ---
+	small_ref(small_ref const& original): m_alloc(original.m_alloc) {
+		if constexpr (fits) {
+			if (original.m_is_inline) {
+				new (m_inline) T(*original.inline_object());
+				m_is_inline = true;
+				return;
+			}
+		}
+		make_in_allocator(*static_cast<T const*>(original.m_data.get()));
+	}
+
+	small_ref& operator=(small_ref const& original) {
+		if (this != &original) {
+			reset();
+			new (this) small_ref(original);
+		}
+		return *this;
+	}
+
+	// --- Move Constructor ---
+	small_ref(small_ref&& original): m_alloc(original.m_alloc), m_is_inline(original.m_is_inline) {
+		if constexpr (fits) {
+			if (m_is_inline) {
+				new (m_inline) T(std::move(*original.inline_object()));
+				return;
+			}
+		}
+		m_data = original.m_data;
+		original.m_data = {nullptr, 0};
+	}
+
+	small_ref& operator=(small_ref&& original) {
+		if (this != &original) {
+			reset();
+			new (this) small_ref(std::move(original));
+		}
+		return *this;
+	}
+
+	bool isInline() {
+		return m_is_inline;
+	}
+
+	// --- Shared Reference ---
+	ref<T> share() {
+		promote();
+		auto res = m_alloc->share(m_data);
+		if (!res.hasData()) {
+			assert(0, "shared_ref not supported, making weak_ref.\n");
+			return { m_data, m_alloc, weak_flag{} };
+		}
+		return { res, m_alloc };
+	}
+
+	ref<T> operator&() {
+		return share();
+	}
+
+	// --- Weak Reference ---
+	ref<T> weak() {
+		promote();
+		return { m_data, m_alloc, weak_flag{} };
+	}
+
+	// --- Accessor ---
+	T* operator->() {
+		if constexpr (fits) {
+			if (m_is_inline) return inline_object();
+		}
+		if (!m_data.hasData()) {
+			assert(0, "nullptr dereference!");
+		}
+		return static_cast<T*>(m_data.get());
+	}
+
+	// --- Deconstructor ---
+	~small_ref() {
+		reset();
+	}
+};
+
 // --- Default Allocator Method ---
 template<class T, class AS, typename... Args>
 ref<AS> alloc_t::make(Args&&... args)  {
     static_assert(std::is_base_of<AS,T>::value);
     auto blk = this->allocate(sizeof(T), alignof(T));
-    new (blk.ptr) T(std::forward<Args>(args)...);
+    new (blk.get()) T(std::forward<Args>(args)...);
+    this->set_relocator(blk, relocator_of<T>());
     return {blk, this};
 }
 
@@ -253,10 +472,16 @@ template<class T, class AS, typename... Args>
 unique_ref<AS> alloc_t::make_unique(Args&&... args) {
     static_assert(std::is_base_of<AS,T>::value);
     auto blk = this->allocate(sizeof(T), alignof(T));
-    new (blk.ptr) T(std::forward<Args>(args)...);
+    new (blk.get()) T(std::forward<Args>(args)...);
+    this->set_relocator(blk, relocator_of<T>());
     return {blk, this};
 }
 
+template<class T, size_t inline_size, typename... Args>
+small_ref<T, inline_size> alloc_t::make_small(Args&&... args) {
+    return {this, std::in_place, std::forward<Args>(args)...};
+}
+
 template<class T, class AS>
 void alloc_t::do_move(ref<T>& original) {
 	if (original.m_alloc == this) {
@@ -375,42 +600,61 @@ class stack_allocator: public alloc_t {
 
 template<class baseAllocator>
 class RefCounted: public baseAllocator {
-	size_t object_count{0};
+	std::atomic<size_t> object_count{0}; // Atomic, AsyncFree<> deallocates from its reclaimer thread.
+
+	using counter = std::atomic<int>;
+
+	static size_t count_offset(size_t size) {
+		return (size + alignof(counter) - 1) & ~(alignof(counter) - 1);
+	}
+
+	static counter* count_of(blk& resource) {
+		return (counter*)((size_t)&resource + count_offset(resource.m_size));
+	}
+
+	void free_block(blk& resource) {
+		resource.m_size = count_offset(resource.m_size) + sizeof(counter); // We need to re add the reference metadata to the blk size, for the underline allocator.
+		object_count-=1;
+		baseAllocator::deallocate(resource);
+	}
  public:
     blk allocate(size_t size, size_t alignment) override {
-        auto total_size = size + sizeof(int);
-        auto block = baseAllocator::allocate(total_size, alignment);
+        auto total_size = count_offset(size) + sizeof(counter);
+        auto block = baseAllocator::allocate(total_size, alignment > alignof(counter) ? alignment : alignof(counter));
 
-        int* count = (int*)((size_t)&block + size);
-        *count = 1;
-        //printf("count = %d\n", *count);
-        block.m_size = size; // Remove the int from the block size, for copying reasons
+        block.m_size = size; // Remove the count from the block size, for copying reasons
+        new (count_of(block)) counter{1};
 
 		object_count+=1;
         return block;
     }
     bool will_free_on_deallocate(blk& resource) override {
-        int* count = (int*)((size_t)&resource + resource.m_size);
-        //printf("count = %d\n", *count);
-        return (*count == 1);
+        return (count_of(resource)->load(std::memory_order_acquire) == 1);
     }
     blk share(blk& resource) override {
-        //puts("making shared\n");
-        int* count = (int*)((size_t)&resource + resource.m_size);
-        *count+=1;
-        //printf("count = %d\n", *count);
+        count_of(resource)->fetch_add(1, std::memory_order_relaxed);
         return {resource.ptr, resource.m_size};
     }
+    bool unshare(blk& resource) override {
+        auto count = count_of(resource);
+        auto current = count->load(std::memory_order_relaxed);
+        while (current > 1) {
+            if (count->compare_exchange_weak(current, current - 1, std::memory_order_acq_rel)) return true;
+        }
+        return false;
+    }
 
-    void deallocate(blk& resource) override {
-        int* count = (int*)((size_t)&resource + resource.m_size);
-        *count-=1;
-
-        resource.m_size += sizeof(int); // We need to re add the reference metadata to the blk size, for the underline allocator.
+    // Whoever takes the count to zero destroys the object, so two handles
+    // released at the same time can never both (or neither) do it.
+    void release(blk& resource, destructor_fn destroy) override {
+        if (count_of(resource)->fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+        destroy(resource.get());
+        free_block(resource);
+    }
 
-        if (*count == 0) {
-			object_count-=1;
-			baseAllocator::deallocate(resource);
+    void deallocate(blk& resource) override {
+        if (count_of(resource)->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            free_block(resource);
         }
     }
 
@@ -420,9 +664,1010 @@ class RefCounted: public baseAllocator {
     }
 };
 
+// --- Epoch Based Reclamation ---
+// Every thread takes a process wide slot number the first time it touches a
+// DeferredRefCounted<> allocator, and gives it back when it exits. Each allocator
+// keeps one epoch_slot per slot number.
+constexpr size_t max_epoch_threads = 64;
+
+// Allocators holding per thread state register here, and are told when a thread
+// gives its slot back so that they can take over what it left behind.
+class epoch_domain {
+	friend class epoch_thread_slot;
+
+	static inline std::mutex s_lock;
+	static inline epoch_domain* s_domains{nullptr};
+	epoch_domain* m_prev{nullptr};
+	epoch_domain* m_next{nullptr};
+	bool m_joined{false};
+ protected:
+	epoch_domain() {
+		std::lock_guard<std::mutex> lock(s_lock);
+		m_next = s_domains;
+		if (m_next) m_next->m_prev = this;
+		s_domains = this;
+		m_joined = true;
+	}
+
+	// Derived destructors call this first, so thread_exit() is never called on a half destroyed domain.
+	void leave() {
+		std::lock_guard<std::mutex> lock(s_lock);
+		if (!m_joined) return;
+		if (m_prev) m_prev->m_next = m_next;
+		else s_domains = m_next;
+		if (m_next) m_next->m_prev = m_prev;
+		m_joined = false;
+	}
+
+	// Called on the exiting thread, before its slot can be handed to another thread.
+	virtual void thread_exit(size_t slot) = 0;
+
+	virtual ~epoch_domain() {
+		leave();
+	}
+};
+
+class epoch_thread_slot {
+	static inline std::atomic<uint64_t> s_in_use{0};
+	size_t m_slot;
+ public:
+	epoch_thread_slot() {
+		auto in_use = s_in_use.load(std::memory_order_relaxed);
+		for (;;) {
+			if (in_use == ~uint64_t(0)) {
+				fprintf(stderr, "Error: More than %zu threads using epoch based reclamation\n", max_epoch_threads);
+				abort();
+			}
+			m_slot = 0;
+			while (in_use & (uint64_t(1) << m_slot)) m_slot+=1;
+			if (s_in_use.compare_exchange_weak(in_use, in_use | (uint64_t(1) << m_slot), std::memory_order_acquire)) break;
+		}
+	}
+
+	epoch_thread_slot(epoch_thread_slot const&) = delete;
+	epoch_thread_slot& operator=(epoch_thread_slot const&) = delete;
+
+	~epoch_thread_slot() {
+		{
+			std::lock_guard<std::mutex> lock(epoch_domain::s_lock);
+			for (auto domain = epoch_domain::s_domains; domain; domain = domain->m_next) {
+				domain->thread_exit(m_slot);
+			}
+		}
+		s_in_use.fetch_and(~(uint64_t(1) << m_slot), std::memory_order_release);
+	}
+
+	size_t index() const {
+		return m_slot;
+	}
+};
+static_assert(max_epoch_threads == 64, "epoch_thread_slot hands out slots from a 64 bit mask");
+
+inline size_t this_thread_slot() {
+	static thread_local epoch_thread_slot slot;
+	return slot.index();
+}
+
+template<class baseAllocator, size_t batch_size = 64>
+class DeferredRefCounted: public baseAllocator, epoch_domain {
+	// Stored after the object, like the count of RefCounted<>. Once the count
+	// reaches zero the footer doubles as the retire list node.
+	struct footer {
+		std::atomic<int> count;
+		size_t size;
+		destructor_fn destroy;
+		footer* next;
+	};
+
+	static constexpr size_t idle = ~size_t(0);
+
+	struct alignas(64) epoch_slot {
+		std::atomic<size_t> active{idle};
+		size_t pinned{0};
+		footer* retired[3]{};
+		size_t retired_epoch[3]{};
+		size_t retired_size[3]{};
+		size_t retired_count{0};
+		size_t collect_at{batch_size};
+		bool reclaiming{false}; // Releases made by destructors while reclaiming are only queued.
+	};
+
+	std::atomic<size_t> m_epoch{0};
+	// Left behind by threads that exited, reclaimed once m_orphan_epoch is old enough.
+	std::mutex m_orphan_lock;
+	std::atomic<footer*> m_orphans{nullptr};
+	size_t m_orphan_epoch{0};
+	std::atomic<size_t> object_count{0};
+	epoch_slot m_slots[max_epoch_threads];
+
+	static size_t footer_offset(size_t size) {
+		return (size + alignof(footer) - 1) & ~(alignof(footer) - 1);
+	}
+
+	static footer* footer_of(blk& resource) {
+		return (footer*)((size_t)&resource + footer_offset(resource.m_size));
+	}
+
+	void reclaim(footer* node) {
+		while (node) {
+			auto next = node->next;
+			blk block{ (void*)((size_t)node - footer_offset(node->size)), node->size };
+			if (node->destroy) node->destroy(block.ptr);
+
+			block.m_size = footer_offset(block.m_size) + sizeof(footer); // Re add the metadata for the underline allocator.
+			baseAllocator::deallocate(block);
+			object_count.fetch_sub(1, std::memory_order_relaxed);
+			node = next;
+		}
+	}
+
+	// Detaches bucket i of slot, so destructors run while reclaiming it can not see it.
+	static footer* detach(epoch_slot& slot, size_t i) {
+		auto list = slot.retired[i];
+		slot.retired[i] = nullptr;
+		slot.retired_count -= slot.retired_size[i];
+		slot.retired_size[i] = 0;
+		return list;
+	}
+
+	// Frees the buckets of this slot that no pinned reader can still see.
+	void collect(epoch_slot& slot) {
+		if (slot.reclaiming) return;
+
+		auto epoch = m_epoch.load(std::memory_order_acquire);
+		footer* lists[4]{};
+		for (size_t i = 0; i < 3; ++i) {
+			if (slot.retired[i] && slot.retired_epoch[i] + 2 <= epoch) {
+				lists[i] = detach(slot, i);
+			}
+		}
+		if (m_orphans.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(m_orphan_lock);
+			if (m_orphan_epoch + 2 <= epoch) lists[3] = m_orphans.exchange(nullptr, std::memory_order_relaxed);
+		}
+
+		slot.reclaiming = true;
+		for (auto list : lists) reclaim(list);
+		slot.reclaiming = false;
+		slot.collect_at = slot.retired_count + batch_size;
+	}
+
+	// Takes over the retire lists of a thread that exited. They are tagged with the
+	// current epoch, which is never earlier than the epoch they were retired in.
+	void thread_exit(size_t index) override {
+		auto& slot = m_slots[index];
+		slot.pinned = 0;
+		slot.active.store(idle, std::memory_order_release);
+		slot.collect_at = batch_size;
+		if (slot.retired_count == 0) return;
+
+		std::lock_guard<std::mutex> lock(m_orphan_lock);
+		m_orphan_epoch = m_epoch.load(std::memory_order_acquire);
+		for (size_t i = 0; i < 3; ++i) {
+			auto list = detach(slot, i);
+			while (list) {
+				auto next = list->next;
+				list->next = m_orphans.load(std::memory_order_relaxed);
+				m_orphans.store(list, std::memory_order_relaxed);
+				list = next;
+			}
+		}
+	}
+
+	// The epoch can only move on once every pinned thread has seen the current one.
+	bool try_advance() {
+		auto epoch = m_epoch.load(std::memory_order_seq_cst);
+		for (auto& slot : m_slots) {
+			auto active = slot.active.load(std::memory_order_seq_cst);
+			if (active != idle && active != epoch) return false;
+		}
+		return m_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+	}
+
+	void retire(footer* node) {
+		auto& slot = m_slots[this_thread_slot()];
+		auto epoch = m_epoch.load(std::memory_order_acquire);
+		auto bucket = epoch % 3;
+
+		if (slot.retired[bucket] && slot.retired_epoch[bucket] != epoch) {
+			// Left over from three epochs ago, nobody can be reading these anymore.
+			// If they can not be collected right now they just wait for this epoch instead.
+			collect(slot);
+		}
+		slot.retired_epoch[bucket] = epoch;
+		node->next = slot.retired[bucket];
+		slot.retired[bucket] = node;
+
+		slot.retired_size[bucket]+=1;
+		slot.retired_count+=1;
+		// Also done while pinned, the epoch can still move on to this thread's own
+		// epoch + 1, and collect() only frees what no pinned thread can see.
+		if (slot.retired_count >= slot.collect_at && !slot.reclaiming) {
+			try_advance();
+			collect(slot);
+		}
+	}
+
+ public:
+	// Readers that look at objects through weak refs on other threads pin the
+	// current epoch, objects released while pinned are not destroyed until unpinned.
+	class epoch_guard {
+		DeferredRefCounted* m_owner;
+	 public:
+		epoch_guard(DeferredRefCounted* owner): m_owner(owner) { m_owner->enter(); }
+		epoch_guard(epoch_guard const&) = delete;
+		epoch_guard& operator=(epoch_guard const&) = delete;
+		~epoch_guard() { m_owner->exit(); }
+	};
+
+	void enter() {
+		auto& slot = m_slots[this_thread_slot()];
+		if (slot.pinned++ != 0) return;
+
+		size_t epoch;
+		do {
+			epoch = m_epoch.load(std::memory_order_seq_cst);
+			slot.active.store(epoch, std::memory_order_seq_cst);
+		} while (epoch != m_epoch.load(std::memory_order_seq_cst));
+	}
+
+	void exit() {
+		auto& slot = m_slots[this_thread_slot()];
+		assert(slot.pinned != 0, "exit() without a matching enter()");
+		if (--slot.pinned == 0) {
+			slot.active.store(idle, std::memory_order_release);
+		}
+	}
+
+	epoch_guard pin() {
+		return { this };
+	}
+
+	// Destroys and frees everything the calling thread, or threads that have
+	// exited, released. Unless another thread is still pinned to an older epoch.
+	void quiesce() {
+		auto& slot = m_slots[this_thread_slot()];
+		assert(slot.pinned == 0, "quiesce() called while pinned");
+		try_advance();
+		try_advance();
+		collect(slot);
+	}
+
+	blk allocate(size_t size, size_t alignment) override {
+		auto total_size = footer_offset(size) + sizeof(footer);
+		auto block = baseAllocator::allocate(total_size, alignment > alignof(footer) ? alignment : alignof(footer));
+
+		block.m_size = size; // Remove the footer from the block size, for copying reasons
+		new (footer_of(block)) footer{ {1}, size, nullptr, nullptr };
+
+		object_count.fetch_add(1, std::memory_order_relaxed);
+		return block;
+	}
+
+	// Destruction is never done by the handle, it happens when the block is reclaimed.
+	bool will_free_on_deallocate(blk&) override { return false; }
+
+	blk share(blk& resource) override {
+		footer_of(resource)->count.fetch_add(1, std::memory_order_relaxed);
+		return {resource.ptr, resource.m_size};
+	}
+
+	void release(blk& resource, destructor_fn destroy) override {
+		auto node = footer_of(resource);
+		if (node->count.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+		node->destroy = destroy;
+		retire(node);
+	}
+
+	void deallocate(blk& resource) override {
+		DeferredRefCounted::release(resource, nullptr);
+	}
+
+	~DeferredRefCounted() override {
+		leave();
+
+		// No other thread can be using the allocator while it is being destroyed.
+		// Destructors run here can release more objects, so repeat until nothing is left.
+		auto& own = m_slots[this_thread_slot()];
+		own.reclaiming = true;
+		for (bool again = true; again;) {
+			again = false;
+			if (auto orphans = m_orphans.exchange(nullptr)) {
+				reclaim(orphans);
+				again = true;
+			}
+			for (auto& slot : m_slots) {
+				for (size_t i = 0; i < 3; ++i) {
+					if (!slot.retired[i]) continue;
+					reclaim(detach(slot, i));
+					again = true;
+				}
+			}
+		}
+		own.reclaiming = false;
+		assert(object_count == 0, "Live references still exist");
+		if (object_count != 0) baseAllocator::deallocateAll();
+	}
+};
+
+// --- Asynchronous Deallocation ---
+// Hands the last release of an object to a background reclaimer thread, which runs
+// the destructor and deallocates, so the releasing thread does not pay for teardown.
+// Releases that only drop a share are done straight away. The queue is bounded,
+// once backlog releases are waiting the releasing thread does the work itself.
+// AsyncFree<> must be the outermost decorator, e.g. AsyncFree<RefCounted<mallocator>>,
+// and the base allocator must be safe to deallocate from another thread.
+// Bases AsyncFree<> can wrap. unshare() has to tell dropping a share apart from the
+// last release (or the base never shares), and deallocate() has to be safe to call
+// from the reclaimer thread. Specialise this to opt another allocator in.
+template<class allocator> struct async_freeable: std::false_type {};
+template<> struct async_freeable<mallocator>: std::true_type {};
+template<> struct async_freeable<standard_mallocator>: std::true_type {};
+template<class baseAllocator> struct async_freeable<RefCounted<baseAllocator>>: async_freeable<baseAllocator> {};
+
+template<class baseAllocator, size_t backlog = 4096>
+class AsyncFree: public baseAllocator {
+	static_assert((backlog & (backlog - 1)) == 0, "backlog must be a power of 2");
+	static_assert(async_freeable<baseAllocator>::value, "AsyncFree<> can not wrap this allocator, see async_freeable");
+
+	struct cell {
+		std::atomic<size_t> sequence;
+		blk block;
+		destructor_fn destroy;
+	};
+
+	// Bounded multi producer queue, one consumer.
+	cell m_cells[backlog];
+	alignas(64) std::atomic<size_t> m_enqueue{0};
+	alignas(64) size_t m_dequeue{0};
+	alignas(64) std::atomic<size_t> m_pending{0};
+	std::atomic<bool> m_stop{false};
+	std::thread m_reclaimer;
+
+	bool push(blk& resource, destructor_fn destroy) {
+		auto pos = m_enqueue.load(std::memory_order_relaxed);
+		for (;;) {
+			auto& slot = m_cells[pos & (backlog - 1)];
+			auto sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence == pos) {
+				if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					slot.block = resource;
+					slot.destroy = destroy;
+					slot.sequence.store(pos + 1, std::memory_order_release);
+					break;
+				}
+			} else if (sequence < pos) {
+				return false; // Full
+			} else {
+				pos = m_enqueue.load(std::memory_order_relaxed);
+			}
+		}
+
+		if (m_pending.fetch_add(1, std::memory_order_release) == 0) {
+			m_pending.notify_one();
+		}
+		return true;
+	}
+
+	bool pop(blk& resource, destructor_fn& destroy) {
+		auto& slot = m_cells[m_dequeue & (backlog - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != m_dequeue + 1) return false;
+
+		resource = slot.block;
+		destroy = slot.destroy;
+		slot.sequence.store(m_dequeue + backlog, std::memory_order_release);
+		m_dequeue+=1;
+		return true;
+	}
+
+	void reclaim(blk& resource, destructor_fn destroy) {
+		if (destroy) destroy(resource.get());
+		baseAllocator::deallocate(resource);
+	}
+
+	void run() {
+		blk resource;
+		destructor_fn destroy;
+		for (;;) {
+			if (pop(resource, destroy)) {
+				reclaim(resource, destroy);
+				m_pending.fetch_sub(1, std::memory_order_release);
+			} else if (m_stop.load(std::memory_order_acquire)) {
+				return;
+			} else if (m_pending.load(std::memory_order_acquire) == 0) {
+				m_pending.wait(0, std::memory_order_acquire);
+			} else {
+				std::this_thread::yield(); // Claimed by a producer, but not written yet.
+			}
+		}
+	}
+ public:
+	AsyncFree() {
+		for (size_t i = 0; i < backlog; ++i) {
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		m_reclaimer = std::thread([this] { run(); });
+	}
+
+	void release(blk& resource, destructor_fn destroy) override {
+		if (this->unshare(resource)) return; // Only dropping a share, cheap.
+		if (!push(resource, destroy)) reclaim(resource, destroy);
+	}
+
+	void deallocate(blk& resource) override {
+		if (!push(resource, nullptr)) baseAllocator::deallocate(resource);
+	}
+
+	// Blocks until the reclaimer has caught up with everything released so far.
+	void flush() {
+		while (m_pending.load(std::memory_order_acquire) != 0) {
+			std::this_thread::yield();
+		}
+	}
+
+	~AsyncFree() override {
+		flush();
+		m_stop.store(true, std::memory_order_release);
+		m_pending.fetch_add(1, std::memory_order_release);
+		m_pending.notify_one();
+		m_reclaimer.join();
+	}
+};
+
+// --- Compacting Allocator ---
+// Objects are bump allocated into pages, and handed out as indirect blks that point
+// at an entry in a handle table. Compacting<> does its own counting, and can not be
+// wrapped in another decorator. compact() moves every live object into fresh dense
+// pages and updates the table, so all the handles sharing the object follow it.
+template<class baseAllocator, size_t page_size = 64 * 1024>
+class Compacting: public baseAllocator {
+	struct page;
+
+	struct entry {
+		void* object; // Next free entry, when not in use.
+	};
+
+	struct alignas(16) object_header {
+		entry* owner; // nullptr once freed.
+		page* home;
+		relocate_fn relocate;
+		unsigned slot_size;
+		int count;
+	};
+
+	struct alignas(16) page {
+		page* prev;
+		page* next;
+		size_t size;
+		size_t used;
+		size_t live;
+		bool large;
+	};
+
+	struct entry_chunk {
+		entry_chunk* next;
+		entry entries[255];
+	};
+
+	static constexpr size_t granularity = alignof(object_header);
+	static constexpr size_t capacity = page_size - sizeof(page);
+
+	page* m_pages{nullptr};
+	page* m_large{nullptr};
+	page* m_current{nullptr};
+	entry_chunk* m_chunks{nullptr};
+	entry* m_free_entries{nullptr};
+	size_t object_count{0};
+
+	static void relocate_bytes(void*, void*) {}
+
+	static object_header* header_of(blk& resource) {
+		assert(resource.isIndirect(), "blk was not allocated by a Compacting allocator");
+		return static_cast<object_header*>(resource.get()) - 1;
+	}
+
+	static object_header* slot_at(page* p, size_t offset) {
+		return (object_header*)((size_t)(p + 1) + offset);
+	}
+
+	page*& list_of(page* p) {
+		return p->large ? m_large : m_pages;
+	}
+
+	page* new_page(size_t size, size_t alignment, bool large) {
+		auto& list = large ? m_large : m_pages;
+		auto block = baseAllocator::allocate(size, alignment);
+		auto p = new (block.ptr) page{ nullptr, list, size, 0, 0, large };
+		if (list) list->prev = p;
+		list = p;
+		return p;
+	}
+
+	void free_page(page* p) {
+		if (p->prev) p->prev->next = p->next;
+		else list_of(p) = p->next;
+		if (p->next) p->next->prev = p->prev;
+		if (p == m_current) m_current = nullptr;
+
+		blk block{ p, p->size };
+		baseAllocator::deallocate(block);
+	}
+
+	entry* new_entry() {
+		if (!m_free_entries) {
+			auto block = baseAllocator::allocate(sizeof(entry_chunk), alignof(entry_chunk));
+			auto chunk = new (block.ptr) entry_chunk{ m_chunks, {} };
+			m_chunks = chunk;
+			for (auto& e : chunk->entries) {
+				e.object = m_free_entries;
+				m_free_entries = &e;
+			}
+		}
+		auto e = m_free_entries;
+		m_free_entries = static_cast<entry*>(e->object);
+		return e;
+	}
+
+	// Finds room for a slot in the current page, starting a new page when it is full.
+	object_header* bump(size_t slot_size) {
+		if (!m_current || m_current->used + slot_size > capacity) {
+			m_current = new_page(page_size, granularity, false);
+		}
+		auto header = slot_at(m_current, m_current->used);
+		header->home = m_current;
+		m_current->used += slot_size;
+		m_current->live += slot_size;
+		return header;
+	}
+
+	bool has_pinned(page* p) {
+		for (size_t offset = 0; offset < p->used; offset += slot_at(p, offset)->slot_size) {
+			auto header = slot_at(p, offset);
+			if (header->owner && header->relocate == nullptr) return true;
+		}
+		return false;
+	}
+
+	void release_all() {
+		while (m_pages) free_page(m_pages);
+		while (m_large) free_page(m_large);
+		while (auto chunk = m_chunks) {
+			m_chunks = chunk->next;
+			blk block{ chunk, sizeof(entry_chunk) };
+			baseAllocator::deallocate(block);
+		}
+		m_free_entries = nullptr;
+		object_count = 0;
+	}
+ public:
+	blk allocate(size_t size, size_t alignment) override {
+		auto slot_size = (sizeof(object_header) + size + granularity - 1) & ~(granularity - 1);
+
+		object_header* header;
+		if (alignment > granularity || slot_size > capacity / 4) {
+			// Big or over aligned objects get a page of their own, and are never moved.
+			alignment = alignment > granularity ? alignment : granularity;
+			auto offset = (sizeof(page) + sizeof(object_header) + alignment - 1) & ~(alignment - 1);
+			auto p = new_page(offset + size, alignment, true);
+			header = (object_header*)((size_t)p + offset) - 1;
+			header->home = p;
+			p->used = p->live = slot_size;
+		} else {
+			header = bump(slot_size);
+		}
+
+		auto owner = new_entry();
+		owner->object = header + 1;
+		header->owner = owner;
+		header->relocate = &relocate_bytes;
+		header->slot_size = (unsigned)slot_size;
+		header->count = 1;
+
+		object_count+=1;
+		return { owner, size | blk::indirect_flag };
+	}
+
+	void set_relocator(blk& resource, relocate_fn relocate) override {
+		header_of(resource)->relocate = relocate;
+	}
+
+	bool will_free_on_deallocate(blk& resource) override {
+		return header_of(resource)->count == 1;
+	}
+
+	blk share(blk& resource) override {
+		header_of(resource)->count+=1;
+		return {resource.ptr, resource.m_size};
+	}
+
+	void deallocate(blk& resource) override {
+		auto header = header_of(resource);
+		if (--header->count != 0) return;
+
+		auto owner = header->owner;
+		owner->object = m_free_entries;
+		m_free_entries = owner;
+		header->owner = nullptr;
+
+		object_count-=1;
+		auto p = header->home;
+		p->live -= header->slot_size;
+		if (p->live != 0) return;
+		if (p == m_current) {
+			p->used = 0; // Nothing left in it, start filling it again from the beginning.
+		} else {
+			free_page(p);
+		}
+	}
+
+	void deallocateAll() override {
+		release_all();
+	}
+
+	// Moves all the live objects into new pages, in the order they were allocated,
+	// and returns the emptied pages to the base allocator. Pages holding an object
+	// that cannot be moved are left as they are. No raw pointers into the allocator
+	// may be held across a call to compact().
+	void compact() {
+		page* old_pages = m_pages;
+		m_pages = nullptr;
+		m_current = nullptr;
+
+		// Pages are pushed on the front of the list, oldest is last.
+		page* oldest = old_pages;
+		while (oldest && oldest->next) oldest = oldest->next;
+
+		for (auto p = oldest; p;) {
+			auto prev = p->prev;
+			p->prev = p->next = nullptr;
+
+			if (has_pinned(p)) {
+				p->next = m_pages;
+				if (m_pages) m_pages->prev = p;
+				m_pages = p;
+				p = prev;
+				continue;
+			}
+
+			for (size_t offset = 0; offset < p->used; offset += slot_at(p, offset)->slot_size) {
+				auto from = slot_at(p, offset);
+				if (!from->owner) continue;
+
+				auto to = bump(from->slot_size);
+				to->owner = from->owner;
+				to->relocate = from->relocate;
+				to->slot_size = from->slot_size;
+				to->count = from->count;
+				if (from->relocate == &relocate_bytes) {
+					memcpy(to + 1, from + 1, from->slot_size - sizeof(object_header));
+				} else {
+					from->relocate(from + 1, to + 1);
+				}
+				to->owner->object = to + 1;
+			}
+
+			blk block{ p, p->size };
+			baseAllocator::deallocate(block);
+			p = prev;
+		}
+	}
+
+	~Compacting() override {
+		assert(object_count == 0, "Live references still exist");
+		release_all();
+	}
+};
+
+// --- Persistent Arena ---
+// A bump allocator over one contiguous region, that can be written out to a file
+// with snapshot() and mapped back in with open(). Objects inside the arena link to
+// each other with arena_ref<T>, an offset from the start of the region, so the graph
+// is valid as soon as it is mapped. Objects must not hold pointers out of the arena,
+// and are never destroyed (will_free_on_deallocate is always false).
+template<class T>
+struct arena_ref {
+	size_t m_offset{0};
+
+	bool hasData() {
+		return (m_offset != 0);
+	}
+};
+
+class persistent_arena: public alloc_t {
+	static constexpr unsigned format_version = 1;
+
+	struct snapshot_header {
+		char magic[8];
+		unsigned format;
+		unsigned version; // Supplied by the user, bump it when the layout of the stored types changes.
+		size_t used;
+		size_t root;
+		size_t checksum;
+	};
+
+	static constexpr size_t data_start = (sizeof(snapshot_header) + 63) & ~size_t(63);
+
+	char* m_base{nullptr};
+	size_t m_capacity;
+	size_t object_count{0};
+
+	snapshot_header* header() {
+		return (snapshot_header*)m_base;
+	}
+
+	void reset() {
+		new (m_base) snapshot_header{ {'A','L','L','O','C','R','E','F'}, format_version, 0, data_start, 0, 0 };
+	}
+
+	size_t checksum(size_t used) {
+		// FNV-1a, a word at a time.
+		size_t hash = 14695981039346656037ull;
+		size_t pos = data_start;
+		for (; pos + sizeof(size_t) <= used; pos += sizeof(size_t)) {
+			size_t word;
+			memcpy(&word, m_base + pos, sizeof(word));
+			hash = (hash ^ word) * 1099511628211ull;
+		}
+		for (; pos < used; ++pos) {
+			hash = (hash ^ (unsigned char)m_base[pos]) * 1099511628211ull;
+		}
+		return hash;
+	}
+ public:
+	// Reserves capacity bytes of address space, pages are only committed as they are used.
+	// On Windows the whole capacity is allocated up front. If the region can not be
+	// reserved the arena stays empty, and allocate(), snapshot() and open() fail.
+	persistent_arena(size_t capacity): m_capacity(capacity) {
+		#ifdef OS_WINDOWS
+			m_base = (char*)_aligned_malloc(capacity, 4096);
+		#else
+			auto p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			m_base = (p == MAP_FAILED) ? nullptr : (char*)p;
+		#endif
+		assert(m_base != nullptr, "persistent_arena could not reserve its region");
+		if (m_base) reset();
+	}
+
+	bool isReserved() {
+		return (m_base != nullptr);
+	}
+
+	persistent_arena(persistent_arena const&) = delete;
+	persistent_arena& operator=(persistent_arena const&) = delete;
+
+	blk allocate(size_t size, size_t alignment) override {
+		if (!m_base) return { };
+		auto pos = (header()->used + alignment - 1) & ~(alignment - 1);
+		if (pos + size > m_capacity) {
+			assert(0, "persistent_arena is full");
+			return { };
+		}
+		header()->used = pos + size;
+		object_count+=1;
+		return { m_base + pos, size };
+	}
+
+	void deallocate(blk&) override {
+		object_count-=1;
+	}
+
+	void deallocateAll() override {
+		object_count = 0;
+		if (m_base) reset();
+	}
+
+	bool will_free_on_deallocate(blk&) override { return false; }
+	blk share(blk& resource) override {
+		object_count+=1;
+		return {resource.ptr, resource.m_size};
+	}
+
+	// --- Offsets ---
+	template<class T> arena_ref<T> offset_of(ref<T>& object) {
+		return offset_of(object.operator->());
+	}
+
+	template<class T> arena_ref<T> offset_of(T* object) {
+		if (!m_base) return { };
+		assert((char*)object >= m_base + data_start && (char*)object < m_base + header()->used, "Object is not in this arena");
+		return { (size_t)((char*)object - m_base) };
+	}
+
+	template<class T> T* get(arena_ref<T> object) {
+		if (!object.hasData() || !m_base) return nullptr;
+		return (T*)(m_base + object.m_offset);
+	}
+
+	// --- Root of the object graph, found again after open() ---
+	template<class T> void set_root(ref<T>& object) {
+		if (!m_base) return;
+		header()->root = offset_of(object).m_offset;
+	}
+
+	template<class T> weak_ref<T> root() {
+		if (!m_base || header()->root == 0) return { blk{}, this };
+		return { blk{ m_base + header()->root, sizeof(T) }, this };
+	}
+
+	// --- Snapshots ---
+	// Writes the header and everything allocated so far to path.
+	bool snapshot(char const* path, unsigned version) {
+		if (!m_base) return false;
+		auto used = header()->used;
+		header()->version = version;
+		header()->checksum = checksum(used);
+
+		auto file = fopen(path, "wb");
+		if (!file) return false;
+		auto written = fwrite(m_base, 1, used, file);
+		return (fclose(file) == 0) && (written == used);
+	}
+
+	// Maps a snapshot written by snapshot() into the arena. Returns false, leaving the
+	// arena empty, if the file is missing, from another version, or does not match its checksum.
+	bool open(char const* path, unsigned version) {
+		assert(object_count == 0, "References to data still exist");
+		if (!m_base) return false;
+
+		snapshot_header stored;
+		auto file = fopen(path, "rb");
+		if (!file) return false;
+		auto valid = fread(&stored, sizeof(stored), 1, file) == 1
+			&& memcmp(stored.magic, "ALLOCREF", sizeof(stored.magic)) == 0
+			&& stored.format == format_version
+			&& stored.version == version
+			&& stored.used >= data_start && stored.used <= m_capacity
+			&& (stored.root == 0 || (stored.root >= data_start && stored.root < stored.used));
+
+		#ifdef OS_OTHER
+			// A truncated file would fault when the missing pages are touched.
+			struct stat info;
+			valid = valid && fstat(fileno(file), &info) == 0 && (size_t)info.st_size >= stored.used;
+		#endif
+
+		if (valid) {
+			#ifdef OS_WINDOWS
+				rewind(file);
+				valid = fread(m_base, 1, stored.used, file) == stored.used;
+			#else
+				// Copy on write, changes made after opening never reach the file.
+				auto p = mmap(m_base, stored.used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(file), 0);
+				valid = (p != MAP_FAILED);
+			#endif
+		}
+		fclose(file);
+
+		if (valid) valid = (checksum(stored.used) == stored.checksum);
+		if (!valid) {
+			#ifdef OS_OTHER
+				mmap(m_base, m_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+			#endif
+			reset();
+		}
+		return valid;
+	}
+
+	~persistent_arena() override {
+		assert(object_count == 0, "References to data still exist");
+		if (!m_base) return;
+		#ifdef OS_WINDOWS
+			_aligned_free(m_base);
+		#else
+			munmap(m_base, m_capacity);
+		#endif
+	}
+};
+
 extern alloc_t* galloc;
 alloc_t* galloc;
 
+// --- Coroutine Frame Allocation ---
+// Derive a coroutine promise_type from frame_promise and its frames are allocated
+// through galloc, or through the allocator passed as the first coroutine argument.
+// e.g. generator<int> numbers(alloc_t& alloc, int count);
+class frame_promise {
+	// Remembers which allocator the frame came from, so it can be returned to it.
+	struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) frame_header {
+		alloc_t* alloc;
+	};
+
+	static void* allocate_frame(alloc_t* alloc, size_t size) {
+		assert(alloc != nullptr);
+		auto block = alloc->allocate(size + sizeof(frame_header), alignof(frame_header));
+		if (!block.hasData()) throw std::bad_alloc{};
+
+		auto header = new (block.ptr) frame_header{ alloc };
+		return header + 1;
+	}
+
+ public:
+	static void* operator new(size_t size) {
+		return allocate_frame(galloc, size);
+	}
+
+	template<typename... Args>
+	static void* operator new(size_t size, alloc_t& alloc, Args const&...) {
+		return allocate_frame(&alloc, size);
+	}
+
+	template<typename... Args>
+	static void* operator new(size_t size, alloc_t* alloc, Args const&...) {
+		return allocate_frame(alloc, size);
+	}
+
+	static void operator delete(void* frame, size_t size) {
+		auto header = static_cast<frame_header*>(frame) - 1;
+		blk block{ header, size + sizeof(frame_header) };
+		header->alloc->deallocate(block);
+	}
+};
+
+// Coroutine frames of the same coroutine are always the same size, and tend to be
+// created and destroyed in LIFO order. Freed frames are kept on a free list per
+// size class and handed straight back out, so the base allocator is rarely touched.
+template<class baseAllocator, size_t max_frame_size = 1024>
+class FrameRecycler: public baseAllocator {
+	static constexpr size_t granularity = 64;
+	static constexpr size_t classes = max_frame_size / granularity;
+
+	struct free_frame {
+		free_frame* next;
+	};
+
+	free_frame* m_free[classes]{};
+
+	static size_t size_class(size_t size) {
+		if (size == 0) return 0; // Empty blocks share the smallest class.
+		return (size - 1) / granularity;
+	}
+ public:
+	blk allocate(size_t size, size_t alignment) override {
+		if (size > max_frame_size) return baseAllocator::allocate(size, alignment);
+		assert(alignment <= granularity, "FrameRecycler does not support over aligned frames");
+
+		auto cls = size_class(size);
+		if (auto frame = m_free[cls]) {
+			m_free[cls] = frame->next;
+			return {frame, size};
+		}
+
+		auto block = baseAllocator::allocate((cls + 1) * granularity, granularity);
+		block.m_size = size; // Only report what was asked for, for copying reasons
+		return block;
+	}
+
+	void deallocate(blk& resource) override {
+		if (resource.m_size > max_frame_size) {
+			baseAllocator::deallocate(resource);
+			return;
+		}
+
+		auto cls = size_class(resource.m_size);
+		m_free[cls] = new (resource.ptr) free_frame{ m_free[cls] };
+	}
+
+	// Returns all the cached frames to the base allocator.
+	void trim() {
+		for (size_t cls = 0; cls < classes; ++cls) {
+			while (auto frame = m_free[cls]) {
+				m_free[cls] = frame->next;
+				blk block{ frame, (cls + 1) * granularity };
+				baseAllocator::deallocate(block);
+			}
+		}
+	}
+
+	void deallocateAll() override {
+		trim();
+		baseAllocator::deallocateAll();
+	}
+
+	~FrameRecycler() override {
+		trim();
+	}
+};
+
 template<class T, class AS = T, typename... Args>
 ref<AS> make(Args&&... args) {
     static_assert(std::is_base_of<AS, T>::value);
@@ -437,6 +1682,12 @@ ref<AS> make_unique(Args&&... args) {
     return galloc->make_unique<T, AS>(std::forward<Args>(args)...);
 }
 
+template<class T, size_t inline_size = 16, typename... Args>
+small_ref<T, inline_size> make_small(Args&&... args) {
+	assert(galloc != nullptr);
+    return galloc->make_small<T, inline_size>(std::forward<Args>(args)...);
+}
+
 template<class T>
 typename std::remove_reference<T>::type&& move(T&& original) {
 	galloc->do_move(original);
@@ -2,6 +2,8 @@
 #include <benchmark/benchmark.h>
 
 #include <string_view>
+#include <coroutine>
+#include <exception>
 
 enum token_type {
 	endOfFile = 0,
@@ -159,15 +161,225 @@ static void Test_RefCountedStackAlloc(benchmark::State& state) {
   }
 }
 
+static void Test_DeferredRefCountedAlignedMalloc(benchmark::State& state) {
+  // Perform setup here
+  for (auto _ : state) {
+	DeferredRefCounted<mallocator> test_alloc{};
+	galloc = &test_alloc;
+    // This code gets timed
+    lex_test();
+  }
+}
+static void Test_AsyncFreeRefCountedAlignedMalloc(benchmark::State& state) {
+  // Perform setup here, the reclaimer thread is started once.
+  AsyncFree<RefCounted<mallocator>> test_alloc{};
+  galloc = &test_alloc;
+  for (auto _ : state) {
+    // This code gets timed
+    lex_test();
+  }
+  test_alloc.flush();
+}
+// --- Small values ---
+struct point {
+	int x;
+	int y;
+};
+
+static void Test_RefSmallValues(benchmark::State& state) {
+  RefCounted<mallocator> test_alloc{};
+  galloc = &test_alloc;
+  for (auto _ : state) {
+	int sum = 0;
+	for (int i = 0; i < 64; ++i) {
+		auto p = make<point>(i, i);
+		sum += p->x + p->y;
+	}
+	benchmark::DoNotOptimize(sum);
+  }
+}
+
+static void Test_SmallRefSmallValues(benchmark::State& state) {
+  RefCounted<mallocator> test_alloc{};
+  galloc = &test_alloc;
+  for (auto _ : state) {
+	int sum = 0;
+	for (int i = 0; i < 64; ++i) {
+		auto p = make_small<point>(i, i);
+		sum += p->x + p->y;
+	}
+	benchmark::DoNotOptimize(sum);
+  }
+}
+
+// --- Coroutine frames ---
+// The same generator and task, with frames from the global operator new (heap_frames)
+// or routed through an alloc_t (frame_promise).
+struct heap_frames {};
+
+template<class T, class FrameBase>
+class generator {
+ public:
+	struct promise_type: FrameBase {
+		T m_value;
+
+		generator get_return_object() { return generator{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		std::suspend_always yield_value(T value) { m_value = value; return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	explicit generator(std::coroutine_handle<promise_type> handle): m_handle(handle) {}
+	generator(generator const&) = delete;
+	~generator() { m_handle.destroy(); }
+
+	bool next() {
+		m_handle.resume();
+		return !m_handle.done();
+	}
+	T value() { return m_handle.promise().m_value; }
+ private:
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+template<class T, class FrameBase>
+class task {
+ public:
+	struct promise_type: FrameBase {
+		T m_value;
+		std::coroutine_handle<> m_continuation;
+
+		struct final_awaiter {
+			bool await_ready() noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+				auto continuation = handle.promise().m_continuation;
+				return continuation ? continuation : std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+
+		task get_return_object() { return task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		final_awaiter final_suspend() noexcept { return {}; }
+		void return_value(T value) { m_value = value; }
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	explicit task(std::coroutine_handle<promise_type> handle): m_handle(handle) {}
+	task(task const&) = delete;
+	~task() { m_handle.destroy(); }
+
+	bool await_ready() { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) {
+		m_handle.promise().m_continuation = continuation;
+		return m_handle;
+	}
+	T await_resume() { return m_handle.promise().m_value; }
+
+	T get() {
+		m_handle.resume();
+		return m_handle.promise().m_value;
+	}
+ private:
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+template<class FrameBase>
+static generator<int, FrameBase> count_to(int limit) {
+	for (int i = 0; i < limit; ++i) co_yield i;
+}
+
+template<class FrameBase>
+static task<int, FrameBase> tree_sum(int depth) {
+	if (depth == 0) co_return 1;
+	auto left = co_await tree_sum<FrameBase>(depth - 1);
+	auto right = co_await tree_sum<FrameBase>(depth - 1);
+	co_return left + right;
+}
+
+template<class FrameBase>
+static void generator_test() {
+	// Many short lived generators, each only yielding a few values.
+	for (int i = 0; i < 64; ++i) {
+		auto numbers = count_to<FrameBase>(8);
+		int sum = 0;
+		while (numbers.next()) sum += numbers.value();
+		benchmark::DoNotOptimize(sum);
+	}
+}
+
+template<class FrameBase>
+static void task_test() {
+	benchmark::DoNotOptimize(tree_sum<FrameBase>(6).get());
+}
+
+static void Test_GeneratorHeapFrames(benchmark::State& state) {
+  for (auto _ : state) {
+    generator_test<heap_frames>();
+  }
+}
+
+static void Test_GeneratorAlignedMallocFrames(benchmark::State& state) {
+  mallocator test_alloc{};
+  galloc = &test_alloc;
+  for (auto _ : state) {
+    generator_test<frame_promise>();
+  }
+}
+
+static void Test_GeneratorFrameRecycler(benchmark::State& state) {
+  FrameRecycler<mallocator> test_alloc{};
+  galloc = &test_alloc;
+  for (auto _ : state) {
+    generator_test<frame_promise>();
+  }
+}
+
+static void Test_TaskHeapFrames(benchmark::State& state) {
+  for (auto _ : state) {
+    task_test<heap_frames>();
+  }
+}
+
+static void Test_TaskAlignedMallocFrames(benchmark::State& state) {
+  mallocator test_alloc{};
+  galloc = &test_alloc;
+  for (auto _ : state) {
+    task_test<frame_promise>();
+  }
+}
+
+static void Test_TaskFrameRecycler(benchmark::State& state) {
+  FrameRecycler<mallocator> test_alloc{};
+  galloc = &test_alloc;
+  for (auto _ : state) {
+    task_test<frame_promise>();
+  }
+}
+
 // Register the function as a benchmark
 BENCHMARK(Test_StandardMalloc)->MinTime(10);
 
 BENCHMARK(Test_RefCountedStandardMalloc)->MinTime(10);
 BENCHMARK(Test_AlignedMalloc)->MinTime(10);
 BENCHMARK(Test_RefCountedAlignedMalloc)->MinTime(10);
+BENCHMARK(Test_DeferredRefCountedAlignedMalloc)->MinTime(10);
+BENCHMARK(Test_AsyncFreeRefCountedAlignedMalloc)->MinTime(10);
 
 
 BENCHMARK(Test_StackAllocator)->MinTime(10);
 BENCHMARK(Test_RefCountedStackAlloc)->MinTime(10);
+
+BENCHMARK(Test_RefSmallValues)->MinTime(10);
+BENCHMARK(Test_SmallRefSmallValues)->MinTime(10);
+
+BENCHMARK(Test_GeneratorHeapFrames)->MinTime(10);
+BENCHMARK(Test_GeneratorAlignedMallocFrames)->MinTime(10);
+BENCHMARK(Test_GeneratorFrameRecycler)->MinTime(10);
+BENCHMARK(Test_TaskHeapFrames)->MinTime(10);
+BENCHMARK(Test_TaskAlignedMallocFrames)->MinTime(10);
+BENCHMARK(Test_TaskFrameRecycler)->MinTime(10);
 // Run the benchmark
 BENCHMARK_MAIN();